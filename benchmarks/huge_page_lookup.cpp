@@ -0,0 +1,65 @@
+// Lookup latency of UnorderedMap with std::allocator and HugePageAllocator.
+//
+//   g++ -std=c++17 -O2 -I.. huge_page_lookup.cpp -o huge_page_lookup
+//   ./huge_page_lookup [keys] [queries] [numa_node]
+
+#include <chrono>
+#include <cstdlib>
+#include <random>
+
+#include "unordered_map.h"
+
+template<typename Map>
+double lookup_latency(Map& map, const std::vector<size_t>& keys, size_t queries) {
+  for (size_t i = 0; i < keys.size(); ++i) {
+    map.emplace(keys[i], i);
+  }
+  std::mt19937_64 random(1);
+  std::vector<size_t> order(queries);
+  for (auto& key : order) {
+    key = keys[random() % keys.size()];
+  }
+  size_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t key : order) {
+    checksum += map.find(key)->second;
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  if (checksum == 1) {
+    std::cout << "";
+  }
+  return std::chrono::duration<double, std::nano>(elapsed).count() / queries;
+}
+
+template<typename Map, typename... Args>
+void run(const char* name, const std::vector<size_t>& keys, size_t queries, Args&&... args) {
+  Map map(std::forward<Args>(args)...);
+  std::cout << name << "\t" << lookup_latency(map, keys, queries) << " ns/lookup\n";
+}
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000000;
+  size_t queries = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 5000000;
+  int numa_node = argc > 3 ? std::atoi(argv[3]) : -1;
+
+  std::mt19937_64 random(0);
+  std::vector<size_t> keys(count);
+  for (auto& key : keys) {
+    key = random();
+  }
+  std::cout << count << " keys, " << queries << " random hits\n";
+
+  using Pair = std::pair<const size_t, size_t>;
+  using Allocator = HugePageAllocator<Pair>;
+  using HugeMap = UnorderedMap<size_t, size_t, std::hash<size_t>, std::equal_to<size_t>, Allocator>;
+
+  run<UnorderedMap<size_t, size_t> >("std::allocator", keys, queries);
+  {
+    HugePageStorage storage(HugePageStorage::default_region_size, numa_node);
+    run<HugeMap>("madvise(MADV_HUGEPAGE)", keys, queries, Allocator(storage));
+  }
+  {
+    HugePageStorage storage(HugePageStorage::default_region_size, numa_node, true);
+    run<HugeMap>("MAP_HUGETLB, fallback", keys, queries, Allocator(storage));
+  }
+}
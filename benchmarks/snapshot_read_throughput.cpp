@@ -0,0 +1,108 @@
+// Read throughput of SnapshotMap against UnorderedMap behind a shared_mutex,
+// with one writer updating the map a few hundred times per second.
+//
+//   g++ -std=c++17 -O2 -pthread -I.. snapshot_read_throughput.cpp -o snapshot_read_throughput
+//   ./snapshot_read_throughput [readers] [seconds] [keys] [writer_sleep_ms]
+
+#include <chrono>
+#include <cstdlib>
+#include <shared_mutex>
+#include <thread>
+
+#include "unordered_map.h"
+
+struct Config {
+  size_t readers;
+  double seconds;
+  int keys;
+  int writer_sleep_ms;
+};
+
+template<typename ReadLoop, typename Write>
+double measure(const Config& config, ReadLoop read_loop, Write write) {
+  std::atomic<bool> stop{false};
+  std::vector<size_t> reads(config.readers);
+  std::vector<std::thread> readers;
+  for (size_t reader = 0; reader < config.readers; ++reader) {
+    readers.emplace_back([&, reader] { reads[reader] = read_loop(reader, stop); });
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&] {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+  while (elapsed() < config.seconds) {
+    write();
+    std::this_thread::sleep_for(std::chrono::milliseconds(config.writer_sleep_ms));
+  }
+  stop = true;
+  for (auto& thread : readers) {
+    thread.join();
+  }
+  size_t total = 0;
+  for (size_t count : reads) {
+    total += count;
+  }
+  return total / elapsed() / 1e6;
+}
+
+int main(int argc, char** argv) {
+  Config config;
+  config.readers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+  config.seconds = argc > 2 ? std::atof(argv[2]) : 2.0;
+  config.keys = argc > 3 ? std::atoi(argv[3]) : 10000;
+  config.writer_sleep_ms = argc > 4 ? std::atoi(argv[4]) : 5;
+  if (config.readers == 0) {
+    config.readers = 1;
+  }
+  std::cout << config.readers << " readers, " << config.keys << " keys, writer every "
+            << config.writer_sleep_ms << " ms\n";
+
+  SnapshotMap<int, int> snapshots;
+  snapshots.update([&](SnapshotMap<int, int>::Map& map) {
+    for (int key = 0; key < config.keys; ++key) {
+      map[key] = key;
+    }
+  });
+  double snapshot_rate = measure(config, [&](size_t seed, std::atomic<bool>& stop) {
+    auto reader = snapshots.reader();
+    unsigned state = seed + 1;
+    size_t count = 0;
+    int value = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      state = state * 1103515245 + 12345;
+      count += reader.find((state >> 8) % config.keys, value);
+    }
+    return count;
+  }, [&] {
+    snapshots.update([](SnapshotMap<int, int>::Map& map) { ++map[0]; });
+  });
+  std::cout << "SnapshotMap\t" << snapshot_rate << " Mreads/s\n";
+
+  UnorderedMap<int, int> map;
+  for (int key = 0; key < config.keys; ++key) {
+    map[key] = key;
+  }
+  std::shared_mutex mutex;
+  double mutex_rate = measure(config, [&](size_t seed, std::atomic<bool>& stop) {
+    unsigned state = seed + 1;
+    size_t count = 0;
+    int value = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      state = state * 1103515245 + 12345;
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      auto iter = map.find((state >> 8) % config.keys);
+      if (iter != map.end()) {
+        value = iter->second;
+        ++count;
+      }
+    }
+    if (value < 0) {
+      std::cout << "";
+    }
+    return count;
+  }, [&] {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    ++map[0];
+  });
+  std::cout << "shared_mutex\t" << mutex_rate << " Mreads/s\n";
+}
@@ -1,7 +1,25 @@
 #pragma once
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/membarrier.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 template<size_t N>
@@ -58,6 +76,228 @@ private:
   StackStorage<N>* store_;
 };
 
+#if defined(__unix__) || defined(__APPLE__)
+class HugePageStorage {
+public:
+  static const size_t huge_page_size = size_t(2) << 20;
+  static const size_t default_region_size = 64 * huge_page_size;
+
+  explicit HugePageStorage(size_t region_size = default_region_size,
+                           int numa_node = -1,
+                           bool explicit_huge_pages = false)
+    : region_size_(round_up(region_size)), numa_node_(numa_node),
+      explicit_huge_pages_(explicit_huge_pages) {
+    while (large_limit_ * 2 <= region_size_ / 2) {
+      large_limit_ *= 2;
+    }
+  }
+
+  HugePageStorage(const HugePageStorage&) = delete;
+
+  HugePageStorage& operator=(const HugePageStorage&) = delete;
+
+  ~HugePageStorage() {
+    for (auto& region : regions_) {
+      munmap(region.first, region.second);
+    }
+  }
+
+  uint8_t* allocate(size_t count, size_t alignment) {
+    SpinLock lock(lock_);
+    if (count > large_limit_) {
+      return map_region(round_up(count));
+    }
+    FreeBlock** free_list = find_free_list(count, alignment);
+    if (free_list != nullptr) {
+      alignment = free_step;
+      if (*free_list != nullptr) {
+        FreeBlock* block = *free_list;
+        *free_list = block->next_;
+        return reinterpret_cast<uint8_t*>(block);
+      }
+    }
+    position_ += (alignment - position_ % alignment) % alignment;
+    if (buffer_ == nullptr || position_ + count > region_size_) {
+      regions_.reserve(regions_.size() + 1);
+      uint8_t* region = map_region(region_size_);
+      regions_.emplace_back(region, region_size_);
+      buffer_ = region;
+      position_ = 0;
+    }
+    uint8_t* result = buffer_ + position_;
+    position_ += count;
+    return result;
+  }
+
+  void deallocate(uint8_t* pointer, size_t count, size_t alignment) noexcept {
+    SpinLock lock(lock_);
+    if (count > large_limit_) {
+      munmap(pointer, round_up(count));
+      return;
+    }
+    FreeBlock** free_list = find_free_list(count, alignment);
+    if (free_list != nullptr) {
+      FreeBlock* block = reinterpret_cast<FreeBlock*>(pointer);
+      block->next_ = *free_list;
+      *free_list = block;
+    }
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock* next_;
+  };
+
+  // aggregate() workers share one storage through a copied allocator.
+  struct SpinLock {
+    explicit SpinLock(std::atomic_flag& flag) : flag_(flag) {
+      while (flag_.test_and_set(std::memory_order_acquire)) {}
+    }
+
+    ~SpinLock() { flag_.clear(std::memory_order_release); }
+
+    std::atomic_flag& flag_;
+  };
+
+  static const size_t free_step = 16;
+  static const size_t free_classes = 16;
+  // MPOL_BIND from <linux/mempolicy.h>, so that libnuma is not required.
+  static const int mpol_bind = 2;
+
+  static size_t round_up(size_t count) noexcept {
+    return (count + huge_page_size - 1) / huge_page_size * huge_page_size;
+  }
+
+  // Blocks up to 256 bytes are kept in 16-byte classes, larger ones (old
+  // bucket arrays among them) in power-of-two classes up to large_limit_.
+  // count is rounded up to the size of the class.
+  FreeBlock** find_free_list(size_t& count, size_t alignment) noexcept {
+    if (alignment > free_step || count == 0) {
+      return nullptr;
+    }
+    if (count <= free_step * free_classes) {
+      count = (count + free_step - 1) / free_step * free_step;
+      return &free_lists_[count / free_step - 1];
+    }
+    size_t bits = 0;
+    while ((size_t(1) << bits) < count) {
+      ++bits;
+    }
+    count = size_t(1) << bits;
+    return &large_lists_[bits];
+  }
+
+  uint8_t* map_region(size_t bytes) {
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (explicit_huge_pages_) {
+      memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (memory == MAP_FAILED) {
+      memory = map_aligned(bytes);
+    }
+    bind_to_node(memory, bytes);
+    return static_cast<uint8_t*>(memory);
+  }
+
+  static void* map_aligned(size_t bytes) {
+    size_t mapped = bytes + huge_page_size;
+    void* memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    uint8_t* begin = static_cast<uint8_t*>(memory);
+    size_t head = (huge_page_size - reinterpret_cast<uintptr_t>(begin) % huge_page_size) % huge_page_size;
+    if (head != 0) {
+      munmap(begin, head);
+    }
+    munmap(begin + head + bytes, huge_page_size - head);
+#ifdef MADV_HUGEPAGE
+    madvise(begin + head, bytes, MADV_HUGEPAGE);
+#endif
+    return begin + head;
+  }
+
+  void bind_to_node(void* memory, size_t bytes) const noexcept {
+#if defined(__linux__) && defined(SYS_mbind)
+    const size_t mask_bits = 8 * sizeof(unsigned long);
+    unsigned long node_mask[1024 / (8 * sizeof(unsigned long))] = {};
+    if (numa_node_ < 0 || static_cast<size_t>(numa_node_) >= 1024) {
+      return;
+    }
+    node_mask[numa_node_ / mask_bits] |= 1UL << (numa_node_ % mask_bits);
+    syscall(SYS_mbind, memory, bytes, mpol_bind, node_mask, 1024, 0);
+#else
+    (void)memory;
+    (void)bytes;
+#endif
+  }
+
+  size_t region_size_;
+  int numa_node_;
+  bool explicit_huge_pages_;
+  uint8_t* buffer_ = nullptr;
+  size_t position_ = 0;
+  size_t large_limit_ = free_step * free_classes;
+  std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+  FreeBlock* free_lists_[free_classes] = {};
+  FreeBlock* large_lists_[8 * sizeof(size_t)] = {};
+  std::vector<std::pair<uint8_t*, size_t> > regions_;
+};
+
+template<typename Type>
+class HugePageAllocator {
+public:
+  using value_type = Type;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+  template<typename Node>
+  struct rebind {
+    using other = HugePageAllocator<Node>;
+  };
+
+  HugePageAllocator() = delete;
+
+  HugePageAllocator(HugePageStorage& other) : store_(&other) {}
+
+  template<typename OtherType>
+  HugePageAllocator(const HugePageAllocator<OtherType>& other)
+    :store_(other.store_) {}
+
+  HugePageAllocator& operator=(const HugePageAllocator& other) = default;
+
+  Type* allocate(size_t count) {
+    return reinterpret_cast<Type*>(store_->allocate(count * sizeof(Type),
+                                                    alignof(Type)));
+  }
+
+  void deallocate(Type* pointer, size_t count) noexcept {
+    store_->deallocate(reinterpret_cast<uint8_t*>(pointer), count * sizeof(Type),
+                       alignof(Type));
+  }
+
+  template<typename OtherType>
+  bool operator==(const HugePageAllocator<OtherType>& other) const noexcept {
+    return store_ == other.store_;
+  }
+
+  template<typename OtherType>
+  bool operator!=(const HugePageAllocator<OtherType>& other) const noexcept {
+    return store_ != other.store_;
+  }
+
+private:
+  template<typename AllType>
+  friend
+  class HugePageAllocator;
+  HugePageStorage* store_;
+};
+#endif
+
 template<typename Type, typename Allocator = std::allocator<Type> >
 class List {
 private:
@@ -255,6 +495,10 @@ public:
   List(List&& other)
     : size_(other.size_),
       fake_node_(other.fake_node_.next_, other.fake_node_.prev_), alloc_(std::move(other.alloc_)) {
+    if (size_ == 0) {
+      fake_node_.next_ = fake_node_.prev_ = &fake_node_;
+      return;
+    }
     other.fake_node_.next_ = other.fake_node_.prev_ = &other.fake_node_;
     fake_node_.next_->prev_ = fake_node_.prev_->next_ = &fake_node_;
     other.size_ = 0;
@@ -327,6 +571,23 @@ public:
     construct_node(it, std::forward<Args>(args)...);
   }
 
+  void splice(const const_iterator& it, List& other) noexcept {
+    if (this == &other || other.size_ == 0) {
+      return;
+    }
+    BaseNode* first = other.fake_node_.next_;
+    BaseNode* last = other.fake_node_.prev_;
+    BaseNode* pointer = it.it_;
+    BaseNode* pointer_prev = pointer->prev_;
+    pointer_prev->next_ = first;
+    first->prev_ = pointer_prev;
+    last->next_ = pointer;
+    pointer->prev_ = last;
+    size_ += other.size_;
+    other.size_ = 0;
+    other.fake_node_.next_ = other.fake_node_.prev_ = &other.fake_node_;
+  }
+
   ~List() {
     delete_list();
   }
@@ -412,6 +673,9 @@ private:
   using ListConstIterator = typename List<ListNode, NodeAllocType>::const_iterator;
   using ListIterator = typename List<ListNode, NodeAllocType>::iterator;
   using Node = typename List<ListNode, NodeAllocType>::Node;
+  using BaseNode = typename List<ListNode, NodeAllocType>::BaseNode;
+  using NodeAllocVector = typename std::allocator_traits<Alloc>::template rebind_alloc<Node*>;
+  using FilterAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<uint32_t>;
 public:
   template<bool isConst>
   class common_iterator {
@@ -469,21 +733,39 @@ public:
     node_pointer_.assign(vec_size, nullptr);
   }
 
+  explicit UnorderedMap(const Alloc& alloc)
+    : node_pointer_(NodeAllocVector(alloc)), filter_(FilterAlloc(alloc)),
+      node_key_value_(NodeAllocType(alloc)), allocator_(alloc), alloc_key_value_(alloc) {
+    node_pointer_.assign(vec_size, nullptr);
+  }
 
   UnorderedMap(const UnorderedMap& other) :
+    node_pointer_(std::allocator_traits<NodeAllocVector>::select_on_container_copy_construction(other.node_pointer_.get_allocator())),
+    filter_(std::allocator_traits<FilterAlloc>::select_on_container_copy_construction(other.filter_.get_allocator())),
+    node_key_value_(NodeAllocTraitsValue::select_on_container_copy_construction(NodeAllocType(other.alloc_key_value_))),
     allocator_(NodeAllocTraits::select_on_container_copy_construction(other.allocator_)),
     alloc_key_value_(std::allocator_traits<Alloc>::select_on_container_copy_construction(other.alloc_key_value_)) {
     node_pointer_.resize(other.node_pointer_.size(), nullptr);
-    for (auto it = other.begin(); it != other.end(); ++it) {
+    filter_ = other.filter_;
+    max_factor = other.max_factor;
+    for (auto iter = other.node_key_value_.begin(); iter != other.node_key_value_.end(); ++iter) {
+      Node* list_node = NodeAllocTraits::allocate(allocator_, 1);
       try {
-        insert(*it);
+        std::allocator_traits<Alloc>::construct(alloc_key_value_, &list_node->node_pointer_.node_, iter->node_);
       } catch(...){
-        node_key_value_.delete_list();
+        NodeAllocTraits::deallocate(allocator_, list_node, 1);
+        throw;
+      }
+      list_node->node_pointer_.hash_ = iter->hash_;
+      size_t hash = iter->hash_ % node_pointer_.size();
+      node_key_value_.construct_node_pointers(node_key_value_.end(), list_node);
+      if (node_pointer_[hash] == nullptr) {
+        node_pointer_[hash] = list_node;
       }
     }
   }
 
-  UnorderedMap(UnorderedMap&& other) : node_pointer_(std::move(other.node_pointer_)),
+  UnorderedMap(UnorderedMap&& other) : node_pointer_(std::move(other.node_pointer_)), filter_(std::move(other.filter_)),
                                        node_key_value_(std::move(other.node_key_value_)), allocator_(std::move(other.allocator_)),
                                        alloc_key_value_(std::move(other.alloc_key_value_)) {}
 
@@ -516,32 +798,24 @@ public:
   size_t size() const noexcept { return node_key_value_.size(); }
 
   Value& at(const Key& key) {
-    size_t hash = hash_(key);
-    size_t hash_mod = hash % node_pointer_.size();
-    if (node_pointer_[hash_mod] == nullptr) {
+    ListIterator iter = find_node(key);
+    if (iter == node_key_value_.end()) {
       throw std::out_of_range("out of range");
     }
-    return index_call(hash_mod, hash, key);
+    return iter->node_.second;
   }
 
   const Value& at(const Key& key) const {
-    size_t hash = hash_(key);
-    size_t hash_mod = hash % node_pointer_.size();
-    if (node_pointer_[hash_mod] == nullptr) {
-      throw std::out_of_range("out of range");
-    }
-    return index_call(hash_mod, hash, key);
+    return const_cast<UnorderedMap*>(this)->at(key);
   }
 
   Value& operator[](const Key& key) {
-    size_t hash = hash_(key);
-    size_t hash_mod = hash % node_pointer_.size();
-    if (node_pointer_[hash_mod] == nullptr) {
+    ListIterator iter = find_node(key);
+    if (iter == node_key_value_.end()) {
       Value default_value = Value();
-      auto iter = emplace(key, std::move(default_value));
-      return iter.first->second;
+      return emplace(key, std::move(default_value)).first->second;
     }
-    return index_call(hash_mod, hash, key);
+    return iter->node_.second;
   }
 
   std::pair<iterator, bool> insert(const NodeType& node) {
@@ -568,15 +842,10 @@ public:
   }
 
   void erase(iterator iter) {
-    size_t hash = hash_(iter->first) % node_pointer_.size();
     if (iter != end()) {
-      Node* value_pointer;
-      auto copy_iter = iter;
-      if ((++copy_iter) != end() && (copy_iter.it_)->hash_ == hash)
-        value_pointer = reinterpret_cast<Node*>(copy_iter.it_.it_);
-      else value_pointer = nullptr;
-      node_key_value_.erase(iter.it_);
-      node_pointer_[hash] = value_pointer;
+      Node* list_node = reinterpret_cast<Node*>(iter.it_.it_);
+      detach_node(list_node);
+      node_key_value_.delete_node(list_node);
     }
   }
 
@@ -608,7 +877,12 @@ public:
   }
 
   void reserve(size_t count) {
+    std::vector<uint32_t, FilterAlloc> filter(filter_.get_allocator());
+    if (!filter_.empty()) {
+      filter.assign(count, 0);
+    }
     node_pointer_.assign(count, nullptr);
+    filter_.swap(filter);
     reconstruct();
   }
 
@@ -624,17 +898,11 @@ public:
     }
     try {
       if (find(list_node->node_pointer_.node_.first) != end()) {
+        std::allocator_traits<Alloc>::destroy(alloc_key_value_, &list_node->node_pointer_.node_);
+        NodeAllocTraits::deallocate(allocator_, list_node, 1);
         return std::make_pair(end(), false);
       }
-      size_t hash;
-      hash = hash_(list_node->node_pointer_.node_.first);
-      list_node->node_pointer_.hash_ = hash;
-      hash %= node_pointer_.size();
-      ListIterator iter = find_place(hash);
-      emplace_elem(iter, list_node);
-      if (node_pointer_[hash] == nullptr) {
-        node_pointer_[hash] = list_node;
-      }
+      attach_node(list_node);
     } catch(...){
       std::allocator_traits<Alloc>::destroy(alloc_key_value_, &list_node->node_pointer_.node_);
       NodeAllocTraits::deallocate(allocator_, list_node, 1);
@@ -671,21 +939,128 @@ public:
     return iterator(find_node(key));
   }
 
+  // Group-by over range: every element is folded into the value of its
+  // key with combine_fn(Value&, element). Each worker pre-aggregates its
+  // slice of the input into one map per owner (hash % threads), owners
+  // fold the partial values together with merge_fn(Value&, Value&) by
+  // moving nodes, and the result is assembled by relinking the owners'
+  // nodes with their cached hashes. Worker maps keep bucket counts
+  // coprime to threads, otherwise the shared residue of their keys would
+  // leave most of their buckets empty. alloc is shared by all workers.
+  template<typename Range, typename KeyFn, typename CombineFn, typename MergeFn>
+  static UnorderedMap aggregate(const Range& range, KeyFn key_fn, CombineFn combine_fn,
+                                MergeFn merge_fn, size_t threads, const Alloc& alloc = Alloc()) {
+    using Iterator = decltype(std::begin(range));
+    threads = std::max<size_t>(threads, 1);
+    size_t count = std::distance(std::begin(range), std::end(range));
+    std::vector<std::vector<UnorderedMap> > staged(threads);
+    for (auto& owners : staged) {
+      owners.reserve(threads);
+      for (size_t owner = 0; owner < threads; ++owner) {
+        owners.emplace_back(alloc);
+        owners.back().reserve(coprime_count(vec_size, threads));
+      }
+    }
+    run_workers(threads, [&](size_t worker) {
+      Hash hash_fn = staged[worker][0].hash_;
+      Iterator iter = std::begin(range);
+      std::advance(iter, count * worker / threads);
+      for (size_t index = count * worker / threads; index < count * (worker + 1) / threads; ++index, ++iter) {
+        Key key = key_fn(*iter);
+        size_t hash = hash_fn(key);
+        combine_fn(staged[worker][hash % threads].value_at(std::move(key), hash, threads), *iter);
+      }
+    });
+    run_workers(threads, [&](size_t worker) {
+      UnorderedMap& part = staged[0][worker];
+      for (size_t source = 1; source < threads; ++source) {
+        part.merge_nodes(staged[source][worker], merge_fn, threads);
+      }
+    });
+    size_t total = 0;
+    for (size_t owner = 0; owner < threads; ++owner) {
+      total += staged[0][owner].size();
+    }
+    UnorderedMap result(alloc);
+    size_t buckets = static_cast<size_t>(total / result.max_factor) + 1;
+    if (buckets < vec_size) {
+      buckets = vec_size;
+    }
+    buckets = (buckets + threads - 1) / threads * threads;
+    result.node_pointer_.assign(buckets, nullptr);
+    run_workers(threads, [&](size_t worker) {
+      UnorderedMap& part = staged[0][worker];
+      List<ListNode, NodeAllocType> relinked{NodeAllocType(part.alloc_key_value_)};
+      relink(part.node_key_value_, relinked, result.node_pointer_);
+      part.node_key_value_.swap(relinked);
+    });
+    for (size_t owner = 0; owner < threads; ++owner) {
+      result.node_key_value_.splice(result.node_key_value_.end(), staged[0][owner].node_key_value_);
+    }
+    return result;
+  }
+
   const_iterator find(const Key& key) const {
-    return const_iterator(find_node(key));
+    return const_iterator(const_cast<UnorderedMap*>(this)->find_node(key));
+  }
+
+  bool contains(const Key& key) const {
+    return find(key) != end();
+  }
+
+  // Opt-in filter with one 32-bit fingerprint mask per bucket, checked
+  // before node_pointer_ so that most misses never reach a list node.
+  void enable_lookup_filter() {
+    if (filter_.empty()) {
+      rebuild_filter();
+    }
+  }
+
+  void disable_lookup_filter() {
+    std::vector<uint32_t, FilterAlloc>(filter_.get_allocator()).swap(filter_);
+  }
+
+  bool lookup_filter_enabled() const noexcept {
+    return !filter_.empty();
+  }
+
+  size_t lookup_filter_memory() const noexcept {
+    return filter_.capacity() * sizeof(uint32_t);
+  }
+
+  double lookup_filter_false_positive_rate() const noexcept {
+    if (filter_.empty()) {
+      return 1.0;
+    }
+    size_t bits = 0;
+    for (uint32_t mask : filter_) {
+      for (; mask != 0; mask &= mask - 1) {
+        ++bits;
+      }
+    }
+    return 1.0 * bits / (32 * filter_.size());
   }
 
 private:
+  template<typename CacheKey, typename CacheValue, typename CacheHash, typename CacheEqual, typename CacheAlloc>
+  friend class LruCache;
+
   ListIterator find_node(const Key& key){
-    size_t hash = hash_(key);
-    size_t hash_mod = hash_(key) % node_pointer_.size();
+    return find_node(key, hash_(key));
+  }
+
+  ListIterator find_node(const Key& key, size_t hash){
+    size_t hash_mod = hash % node_pointer_.size();
     ListIterator end = node_key_value_.end();
+    if (!filter_.empty() && (filter_[hash_mod] & fingerprint(hash)) == 0) {
+      return end;
+    }
     if (node_pointer_[hash_mod] == nullptr) {
       return end;
     }
     auto iter = ListIterator(node_pointer_[hash_mod]);
-    while (iter != end && iter->hash_ == hash) {
-      if (equal_(iter->node_.first, key)) {
+    while (iter != end && iter->hash_ % node_pointer_.size() == hash_mod) {
+      if (iter->hash_ == hash && equal_(iter->node_.first, key)) {
         return iter;
       }
       ++iter;
@@ -693,14 +1068,81 @@ private:
     return end;
   }
 
-  void erase_node(Node*& list_node) noexcept {
+  void attach_node(Node* list_node) {
+    attach_node(list_node, hash_(list_node->node_pointer_.node_.first));
+  }
+
+  void attach_node(Node* list_node, size_t hash) noexcept {
+    list_node->node_pointer_.hash_ = hash;
+    if (!filter_.empty()) {
+      filter_[hash % node_pointer_.size()] |= fingerprint(hash);
+    }
+    hash %= node_pointer_.size();
+    ListIterator iter = find_place(hash);
+    emplace_elem(iter, list_node);
+    if (node_pointer_[hash] == nullptr) {
+      node_pointer_[hash] = list_node;
+    }
+  }
+
+  void detach_node(Node* list_node) noexcept {
+    size_t hash = list_node->node_pointer_.hash_ % node_pointer_.size();
+    if (node_pointer_[hash] == list_node) {
+      BaseNode* next = list_node->next_;
+      if (next != &node_key_value_.fake_node_ &&
+          static_cast<Node*>(next)->node_pointer_.hash_ % node_pointer_.size() == hash) {
+        node_pointer_[hash] = static_cast<Node*>(next);
+      } else {
+        node_pointer_[hash] = nullptr;
+      }
+    }
+    erase_node(list_node);
+    --node_key_value_.size_;
+    if (!filter_.empty()) {
+      filter_[hash] = 0;
+      for (auto iter = find_place(hash); iter != node_key_value_.end() &&
+           iter->hash_ % node_pointer_.size() == hash; ++iter) {
+        filter_[hash] |= fingerprint(iter->hash_);
+      }
+    }
+  }
+
+  iterator iterator_to(NodeType& value) noexcept {
+    BaseNode* first = node_key_value_.fake_node_.next_;
+    ptrdiff_t offset = reinterpret_cast<char*>(&static_cast<Node*>(first)->node_pointer_.node_) -
+                       reinterpret_cast<char*>(first);
+    return iterator(ListIterator(reinterpret_cast<BaseNode*>(reinterpret_cast<char*>(&value) - offset)));
+  }
+
+  template<typename ...Args>
+  iterator replace_node(iterator iter, Args&& ... args) {
+    Node* list_node = reinterpret_cast<Node*>(iter.it_.it_);
+    detach_node(list_node);
+    std::allocator_traits<Alloc>::destroy(alloc_key_value_, &list_node->node_pointer_.node_);
+    try {
+      std::allocator_traits<Alloc>::construct(alloc_key_value_, &list_node->node_pointer_.node_, std::forward<Args>(args)...);
+    } catch(...){
+      NodeAllocTraits::deallocate(allocator_, list_node, 1);
+      throw;
+    }
+    try {
+      attach_node(list_node);
+    } catch(...){
+      std::allocator_traits<Alloc>::destroy(alloc_key_value_, &list_node->node_pointer_.node_);
+      NodeAllocTraits::deallocate(allocator_, list_node, 1);
+      throw;
+    }
+    return iterator(ListIterator(list_node));
+  }
+
+  void erase_node(Node* list_node) noexcept {
     list_node->prev_->next_ = list_node->next_;
     list_node->next_->prev_ = list_node->prev_;
     list_node->prev_ = nullptr;
     list_node->next_ = nullptr;
   }
 
-  void emplace_elem(ListIterator iter, Node*& list_node) noexcept {
+  void emplace_elem(ListIterator iter, Node* list_node) noexcept {
     iter.it_->next_->prev_ = list_node;
     list_node->next_ = iter.it_->next_;
     iter.it_->next_ = list_node;
@@ -716,49 +1158,494 @@ private:
   }
 
   void reconstruct() {
-    List<ListNode, NodeAllocType> new_list;
+    List<ListNode, NodeAllocType> new_list{NodeAllocType(alloc_key_value_)};
     node_key_value_.swap(new_list);
-    for (auto iter = new_list.begin(); iter != new_list.end();) {
+    relink(new_list, node_key_value_, node_pointer_);
+    fill_filter();
+  }
+
+  static uint32_t fingerprint(size_t hash) noexcept {
+    return uint32_t(1) << (static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL >> 59);
+  }
+
+  void rebuild_filter() {
+    filter_.assign(node_pointer_.size(), 0);
+    fill_filter();
+  }
+
+  // Expects filter_ to be empty or already sized to node_pointer_.
+  void fill_filter() noexcept {
+    if (filter_.empty()) {
+      return;
+    }
+    std::fill(filter_.begin(), filter_.end(), 0);
+    for (auto iter = node_key_value_.begin(); iter != node_key_value_.end(); ++iter) {
+      filter_[iter->hash_ % node_pointer_.size()] |= fingerprint(iter->hash_);
+    }
+  }
+
+  static void relink(List<ListNode, NodeAllocType>& source, List<ListNode, NodeAllocType>& target,
+                     std::vector<Node*, NodeAllocVector>& buckets) noexcept {
+    for (auto iter = source.begin(); iter != source.end();) {
       ListIterator copy_iter = iter;
       ++iter;
       Node* list_node = reinterpret_cast<Node*>(copy_iter.it_);
-      size_t hash = copy_iter->hash_ % node_pointer_.size();
-      ListIterator place = find_place(hash);
-      erase_node(list_node);
-      --new_list.size_;
-      emplace_elem(place, list_node);
-      if (node_pointer_[hash] == nullptr) {
-        node_pointer_[hash] = list_node;
+      size_t hash = copy_iter->hash_ % buckets.size();
+      BaseNode* place = buckets[hash] == nullptr ? &target.fake_node_ : buckets[hash];
+      list_node->prev_ = place;
+      list_node->next_ = place->next_;
+      place->next_->prev_ = list_node;
+      place->next_ = list_node;
+      ++target.size_;
+      if (buckets[hash] == nullptr) {
+        buckets[hash] = list_node;
       }
     }
+    source.size_ = 0;
+    source.fake_node_.next_ = source.fake_node_.prev_ = &source.fake_node_;
   }
 
-  Value& index_call(size_t hash_mod, size_t hash, const Key& key){
-    auto iter = ListIterator(node_pointer_[hash_mod]);
-    while (iter != node_key_value_.end() && iter->hash_ == hash) {
-      if (equal_(iter->node_.first, key)) {
-        return iter->node_.second;
+  template<typename KeyArg>
+  Value& value_at(KeyArg&& key, size_t hash, size_t stride) {
+    ListIterator iter = find_node(key, hash);
+    if (iter != node_key_value_.end()) {
+      return iter->node_.second;
+    }
+    rehash_coprime(stride);
+    Node* list_node = NodeAllocTraits::allocate(allocator_, 1);
+    try {
+      std::allocator_traits<Alloc>::construct(alloc_key_value_, &list_node->node_pointer_.node_,
+                                              std::forward<KeyArg>(key), Value());
+    } catch(...){
+      NodeAllocTraits::deallocate(allocator_, list_node, 1);
+      throw;
+    }
+    attach_node(list_node, hash);
+    return list_node->node_pointer_.node_.second;
+  }
+
+  // Moves every node of source into this map, folding the values of keys
+  // already present with merge_fn. Nodes keep their memory and cached hash.
+  template<typename MergeFn>
+  void merge_nodes(UnorderedMap& source, MergeFn& merge_fn, size_t stride) {
+    while (source.size() != 0) {
+      Node* list_node = static_cast<Node*>(source.node_key_value_.fake_node_.next_);
+      size_t hash = list_node->node_pointer_.hash_;
+      ListIterator iter = find_node(list_node->node_pointer_.node_.first, hash);
+      if (iter != node_key_value_.end()) {
+        merge_fn(iter->node_.second, list_node->node_pointer_.node_.second);
+        source.detach_node(list_node);
+        source.node_key_value_.delete_node(list_node);
+      } else {
+        rehash_coprime(stride);
+        source.detach_node(list_node);
+        attach_node(list_node, hash);
+      }
+    }
+  }
+
+  void rehash_coprime(size_t stride) {
+    if (load_factor() >= max_factor) {
+      reserve(coprime_count(2 * size() / max_factor, stride));
+    }
+  }
+
+  static size_t coprime_count(size_t count, size_t stride) noexcept {
+    for (;; ++count) {
+      size_t first = count;
+      size_t second = stride;
+      while (second != 0) {
+        size_t rest = first % second;
+        first = second;
+        second = rest;
+      }
+      if (first == 1) {
+        return count;
+      }
+    }
+  }
+
+  template<typename Task>
+  static void run_workers(size_t threads, Task task) {
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    auto guarded = [&](size_t worker) {
+      try {
+        task(worker);
+      } catch(...){
+        errors[worker] = std::current_exception();
+      }
+    };
+    try {
+      for (size_t worker = 1; worker < threads; ++worker) {
+        workers.emplace_back(guarded, worker);
+      }
+    } catch(...){
+      for (auto& thread : workers) {
+        thread.join();
+      }
+      throw;
+    }
+    guarded(0);
+    for (auto& thread : workers) {
+      thread.join();
+    }
+    for (auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
       }
-      ++iter;
     }
-    return iter->node_.second;
   }
 
   void swap(UnorderedMap& other) noexcept {
     std::swap(node_pointer_, other.node_pointer_);
+    std::swap(filter_, other.filter_);
     std::swap(max_factor, other.max_factor);
     node_key_value_.swap(other.node_key_value_);
   }
 
   static const size_t vec_size = 8;
   float max_factor = 1.0;
-  using NodeAllocVector = typename std::allocator_traits<Alloc>::template rebind_alloc<Node*>;
   using NodeAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
   using NodeAllocTraits = std::allocator_traits<NodeAlloc>;
   std::vector<Node*, NodeAllocVector> node_pointer_;
+  std::vector<uint32_t, FilterAlloc> filter_;
   List<ListNode, NodeAllocType> node_key_value_;
   Hash hash_;
   Equal equal_;
   NodeAlloc allocator_;
   Alloc alloc_key_value_;
 };
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>,
+  typename Equal = std::equal_to<Key>, typename Alloc = std::allocator<std::pair<const Key, Value> > >
+class LruCache {
+private:
+  struct Entry;
+  using Item = std::pair<const Key, Entry>;
+  struct Entry {
+    Entry(Value&& value) : value_(std::move(value)) {}
+
+    Value value_;
+    Item* newer_ = nullptr;
+    Item* older_ = nullptr;
+  };
+  using ItemAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Item>;
+  using Map = UnorderedMap<Key, Entry, Hash, Equal, ItemAlloc>;
+
+public:
+  using EvictionCallback = std::function<void(const Key&, Value&)>;
+
+  explicit LruCache(size_t capacity) : capacity_(capacity) {}
+
+  LruCache(size_t capacity, const Alloc& alloc) : capacity_(capacity), map_(ItemAlloc(alloc)) {}
+
+  LruCache(const LruCache&) = delete;
+
+  LruCache& operator=(const LruCache&) = delete;
+
+  size_t size() const noexcept { return map_.size(); }
+
+  size_t capacity() const noexcept { return capacity_; }
+
+  size_t hits() const noexcept { return hits_; }
+
+  size_t misses() const noexcept { return misses_; }
+
+  size_t evictions() const noexcept { return evictions_; }
+
+  void reset_counters() noexcept {
+    hits_ = misses_ = evictions_ = 0;
+  }
+
+  void set_eviction_callback(EvictionCallback callback) {
+    on_evict_ = std::move(callback);
+  }
+
+  Value* get(const Key& key) {
+    auto iter = map_.find(key);
+    if (iter == map_.end()) {
+      ++misses_;
+      return nullptr;
+    }
+    ++hits_;
+    Item* item = &*iter;
+    unlink(item);
+    push_front(item);
+    return &item->second.value_;
+  }
+
+  const Value* peek(const Key& key) const {
+    auto iter = map_.find(key);
+    if (iter == map_.end()) {
+      return nullptr;
+    }
+    return &iter->second.value_;
+  }
+
+  void put(const Key& key, Value value) {
+    auto iter = map_.find(key);
+    if (iter != map_.end()) {
+      Item* item = &*iter;
+      item->second.value_ = std::move(value);
+      unlink(item);
+      push_front(item);
+      return;
+    }
+    if (capacity_ == 0) {
+      return;
+    }
+    Item* item;
+    if (map_.size() >= capacity_) {
+      Item* victim = oldest_;
+      if (on_evict_) {
+        on_evict_(victim->first, victim->second.value_);
+      }
+      unlink(victim);
+      ++evictions_;
+      item = &*map_.replace_node(map_.iterator_to(*victim), key, std::move(value));
+    } else {
+      item = &*map_.emplace(key, std::move(value)).first;
+    }
+    push_front(item);
+  }
+
+  bool erase(const Key& key) {
+    auto iter = map_.find(key);
+    if (iter == map_.end()) {
+      return false;
+    }
+    unlink(&*iter);
+    map_.erase(iter);
+    return true;
+  }
+
+private:
+  void unlink(Item* item) noexcept {
+    Entry& entry = item->second;
+    (entry.newer_ != nullptr ? entry.newer_->second.older_ : newest_) = entry.older_;
+    (entry.older_ != nullptr ? entry.older_->second.newer_ : oldest_) = entry.newer_;
+    entry.newer_ = entry.older_ = nullptr;
+  }
+
+  void push_front(Item* item) noexcept {
+    item->second.older_ = newest_;
+    if (newest_ != nullptr) {
+      newest_->second.newer_ = item;
+    } else {
+      oldest_ = item;
+    }
+    newest_ = item;
+  }
+
+  size_t capacity_;
+  Map map_;
+  Item* newest_ = nullptr;
+  Item* oldest_ = nullptr;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+  EvictionCallback on_evict_;
+};
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>,
+  typename Equal = std::equal_to<Key>, typename Alloc = std::allocator<std::pair<const Key, Value> > >
+class SnapshotMap {
+public:
+  using Map = UnorderedMap<Key, Value, Hash, Equal, Alloc>;
+
+private:
+  // epoch_ sits behind 64 bytes of padding on either side, so no other
+  // object shares its cache line even without over-aligned new.
+  struct Slot {
+    bool in_use_ = false;
+    char before_[64];
+    std::atomic<uint64_t> epoch_{0};
+    char after_[64];
+  };
+
+public:
+  // Read handle owned by one thread. Reads pin the current epoch with a
+  // relaxed store into the handle's own cache line followed by a compiler
+  // barrier; the matching full barrier is issued by the writer through
+  // membarrier(). Without membarrier readers fall back to a full fence.
+  class Reader {
+  public:
+    Reader(const Reader&) = delete;
+
+    Reader& operator=(const Reader&) = delete;
+
+    Reader(Reader&& other) noexcept : owner_(other.owner_), slot_(other.slot_) {
+      other.slot_ = nullptr;
+    }
+
+    ~Reader() {
+      if (slot_ != nullptr) {
+        owner_->release(slot_);
+      }
+    }
+
+    template<typename Fn>
+    auto read(Fn fn) -> decltype(fn(std::declval<const Map&>())) {
+      struct Pin {
+        ~Pin() { slot_->epoch_.store(0, std::memory_order_release); }
+
+        Slot* slot_;
+      } pin{slot_};
+      slot_->epoch_.store(owner_->epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+      if (owner_->asymmetric_) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+      } else {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+      return fn(*owner_->current_.load(std::memory_order_acquire));
+    }
+
+    bool find(const Key& key, Value& value) {
+      return read([&](const Map& map) {
+        auto iter = map.find(key);
+        if (iter == map.end()) {
+          return false;
+        }
+        value = iter->second;
+        return true;
+      });
+    }
+
+    Value at(const Key& key) {
+      return read([&](const Map& map) { return map.at(key); });
+    }
+
+    bool contains(const Key& key) {
+      return read([&](const Map& map) { return map.contains(key); });
+    }
+
+  private:
+    friend class SnapshotMap;
+
+    Reader(SnapshotMap* owner, Slot* slot) : owner_(owner), slot_(slot) {}
+
+    SnapshotMap* owner_;
+    Slot* slot_;
+  };
+
+  SnapshotMap() : current_(new Map()), asymmetric_(register_membarrier()) {}
+
+  explicit SnapshotMap(Map map) : current_(new Map(std::move(map))), asymmetric_(register_membarrier()) {}
+
+  SnapshotMap(const SnapshotMap&) = delete;
+
+  SnapshotMap& operator=(const SnapshotMap&) = delete;
+
+  ~SnapshotMap() {
+    delete current_.load();
+    for (auto& retired : retired_) {
+      delete retired.first;
+    }
+  }
+
+  Reader reader() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+      if (!slot->in_use_) {
+        slot->in_use_ = true;
+        return Reader(this, slot.get());
+      }
+    }
+    slots_.emplace_back(new Slot());
+    slots_.back()->in_use_ = true;
+    return Reader(this, slots_.back().get());
+  }
+
+  // Copies the current version (keeping its bucket layout and cached
+  // hashes), lets fn modify the copy and publishes it.
+  template<typename Fn>
+  void update(Fn fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Map> next(new Map(*current_.load(std::memory_order_relaxed)));
+    fn(*next);
+    publish(std::move(next));
+  }
+
+  void assign(Map map) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Map> next(new Map(std::move(map)));
+    publish(std::move(next));
+  }
+
+  void insert_or_assign(const Key& key, const Value& value) {
+    update([&](Map& map) { map[key] = value; });
+  }
+
+  void erase(const Key& key) {
+    update([&](Map& map) { map.erase(key); });
+  }
+
+  size_t pending_versions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return retired_.size();
+  }
+
+private:
+  void publish(std::unique_ptr<Map> next) {
+    if (retired_.size() == retired_.capacity()) {
+      retired_.reserve(2 * retired_.size() + 1);
+    }
+    const Map* previous = current_.exchange(next.release(), std::memory_order_seq_cst);
+    retired_.emplace_back(previous, epoch_.fetch_add(1, std::memory_order_seq_cst));
+    if (heavy_fence()) {
+      reclaim();
+    }
+  }
+
+  static bool register_membarrier() noexcept {
+#if defined(__linux__) && defined(SYS_membarrier)
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#else
+    return false;
+#endif
+  }
+
+  // Orders every reader's slot store before the slot scan in reclaim().
+  bool heavy_fence() const noexcept {
+    if (!asymmetric_) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return true;
+    }
+#if defined(__linux__) && defined(SYS_membarrier)
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0;
+#else
+    return false;
+#endif
+  }
+
+  void reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    for (auto& slot : slots_) {
+      uint64_t epoch = slot->epoch_.load(std::memory_order_seq_cst);
+      if (epoch != 0 && epoch < oldest) {
+        oldest = epoch;
+      }
+    }
+    // Tags grow with every publish, so the reclaimable versions are a prefix.
+    size_t freed = 0;
+    while (freed < retired_.size() && retired_[freed].second < oldest) {
+      delete retired_[freed++].first;
+    }
+    if (freed != 0) {
+      retired_.erase(retired_.begin(), retired_.begin() + freed);
+    }
+  }
+
+  void release(Slot* slot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slot->in_use_ = false;
+  }
+
+  std::atomic<const Map*> current_;
+  std::atomic<uint64_t> epoch_{1};
+  const bool asymmetric_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Slot> > slots_;
+  std::vector<std::pair<const Map*, uint64_t> > retired_;
+};